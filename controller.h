@@ -0,0 +1,230 @@
+#pragma once
+
+// The fan control law, without any of the SMC I/O, so that it can be
+// replayed offline or embedded in other programs. See fancurve.h for C.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+
+namespace fancurve {
+
+/// Which temperature curve a sensor is held to.
+enum class sensor_class { hot, warm, skin, other };
+inline constexpr int sensor_class_count = 4;
+
+// Sort a temperature sensor by its key, e.g. 'TC0C'.
+inline sensor_class classify(std::uint32_t k) {
+  char key[4] = {char(k >> 24), char(k >> 16), char(k >> 8), char(k)};
+  if(key[1] == 's') {
+    // "skin" sensor, for the case.
+    return sensor_class::skin;
+  }
+  else if(key[1] == 'C' && key[3] != 'P') {
+    // This includes CPU cores and other on-die sensors
+    // that run hotter than the rest of the board.
+    return sensor_class::hot;
+  }
+  else if(key[1] == 'G' && key[3] != 'P') {
+    // GPU sensors (that aren't proximity).
+    return sensor_class::hot;
+  }
+  else if(key[1] == 'T' && (key[2] == 'L' || key[2] == 'R') && key[3] == 'D') {
+    // Thunderbolt ports.
+    // Maybe this should just be the same as the cold other sensors,
+    // but this was what was generally setting off my fans when docked
+    // so I want to try letting them get warmer.
+    return sensor_class::warm;
+  }
+  else if(key[1] == 'P' && key[2] == 'C' && key[3] == 'D') {
+    // PCH
+    // Same deal, this is what is generally tripping the fans, and is
+    // fine to be hotter. I'd say 80 degC is on the high end of fine,
+    // and that's where the "warm" curve maxes out. So, perfect.
+    return sensor_class::warm;
+  }
+  return sensor_class::other;
+}
+
+/// Temperature range that linearly maps onto 0%-100% fan.
+struct curve {
+  float low;
+  float high;
+  float operator ()(float val) const {
+    return (val - low) / (high - low);
+  }
+};
+
+/// The tunable parts of the control law.
+struct curve_params {
+  // It's possible that "hot" should be changed to MUCH hotter.
+  // This is because it's not like turning the fans up does much to
+  // change on-die temperatures, when we're already keeping the
+  // heatsinks and finstacks cool.
+  // Let's try it.
+  //curve hot = {69., 83.};
+  curve hot = {82., 96.};
+  curve warm = {65., 79.};
+  curve skin_docked = {40., 45.};
+  curve skin = {36., 40.};
+  curve other = {60., 70.};
+  int floor = 0; // Lowest fan percentage.
+  int window = 3; // Number of ticks the median filter looks at.
+
+  const curve &operator ()(sensor_class c, bool docked) const {
+    switch(c) {
+      case sensor_class::hot: return hot;
+      case sensor_class::warm: return warm;
+      case sensor_class::skin: return docked ? skin_docked : skin;
+      default: return other;
+    }
+  }
+
+  // Parse a "name=value" argument into these params.
+  // Returns false if the argument isn't a param or is malformed.
+  bool parse(const char *arg) {
+    auto parse_curve = [](const char *s, curve &c) {
+      curve n;
+      if(std::sscanf(s, "%f:%f", &n.low, &n.high) != 2 || !(n.high > n.low))
+        return false;
+      c = n;
+      return true;
+    };
+    if(std::strncmp(arg, "hot=", 4) == 0)
+      return parse_curve(arg + 4, hot);
+    if(std::strncmp(arg, "warm=", 5) == 0)
+      return parse_curve(arg + 5, warm);
+    if(std::strncmp(arg, "dock=", 5) == 0)
+      return parse_curve(arg + 5, skin_docked);
+    if(std::strncmp(arg, "skin=", 5) == 0)
+      return parse_curve(arg + 5, skin);
+    if(std::strncmp(arg, "other=", 6) == 0)
+      return parse_curve(arg + 6, other);
+    if(std::strncmp(arg, "floor=", 6) == 0)
+      return std::sscanf(arg + 6, "%d", &floor) == 1 && floor >= 0 && floor <= 99;
+    if(std::strncmp(arg, "window=", 7) == 0)
+      return std::sscanf(arg + 7, "%d", &window) == 1 && window >= 1 && window <= 9;
+    return false;
+  }
+
+  // Print in the same format that parse() accepts.
+  void print(FILE *f) const {
+    std::fprintf(f, "hot=%g:%g warm=%g:%g dock=%g:%g skin=%g:%g other=%g:%g floor=%d window=%d",
+      hot.low, hot.high, warm.low, warm.high, skin_docked.low, skin_docked.high,
+      skin.low, skin.high, other.low, other.high, floor, window);
+  }
+};
+
+// actually only goes to 99
+inline int to_percent(float lin) {
+  return lin >= 0.99 ? 99
+       : lin <= 0.0 ? 0
+       : int(99*(lin + 0.01));
+}
+
+/// Median of the last few target percentages.
+/// This is mostly because cpu core temps (TC%dC) are spiky.
+class median_filter {
+  char roll[9];
+  int window;
+public:
+  int median;
+  int peak; // Max over the window.
+
+  // fans will start maxed as a "hello, it's working"
+  explicit median_filter(int window) : window(window), median(99), peak(99) {
+    std::fill(&roll[0], &roll[9], 99);
+  }
+
+  void push(int percent) {
+    std::copy(&roll[1], &roll[window], &roll[0]);
+    roll[window-1] = percent;
+    char sorted[9];
+    std::copy(&roll[0], &roll[window], &sorted[0]);
+    std::sort(&sorted[0], &sorted[window]);
+    median = sorted[window/2];
+    peak = sorted[window-1];
+  }
+};
+
+// Sleep 2-7 seconds; updates come slower when temps are cool.
+// FWIW: 3 second update interval was giving (sys+user)/real = 0.1%
+// On battery, sleep 4-10 seconds instead.
+inline useconds_t tick_interval(int peak, bool battery = false) {
+  if(battery)
+    return 4'000'000 + int(6'000'000 * (1. - peak/99.));
+  return 2'000'000 + int(5'000'000 * (1. - peak/99.));
+}
+
+/// One tick's worth of input to a Controller.
+struct snapshot {
+  const float *temps; // One per sensor, in the order the Controller was given.
+  bool docked;
+  bool battery;
+};
+
+/// What a Controller wants done after a tick.
+struct targets {
+  int percent; // Fan speed to set, 0-99.
+  int raw_percent; // What this tick alone asked for, before filtering.
+  int hottest; // Index of the sensor responsible for raw_percent, or -1.
+  useconds_t interval; // How long to wait before the next step.
+};
+
+/// The control law: temps in, fan speed out.
+/// Deterministic, and step() doesn't allocate, so it can be embedded anywhere.
+class Controller {
+  curve_params params_;
+  std::vector<sensor_class> classes;
+  median_filter filter;
+  float headroom_[sensor_class_count];
+
+public:
+  Controller(const curve_params &params, std::vector<sensor_class> classes)
+    : params_(params), classes(std::move(classes)), filter(params.window) {
+    std::fill(&headroom_[0], &headroom_[sensor_class_count], NAN);
+  }
+
+  const curve_params &params() const { return params_; }
+  std::size_t size() const { return classes.size(); }
+
+  targets step(const snapshot &s) {
+    targets t;
+    float max_lin = -INFINITY;
+    t.hottest = -1;
+    std::fill(&headroom_[0], &headroom_[sensor_class_count], NAN);
+    for(std::size_t i = 0; i < classes.size(); ++i) {
+      float lin = params_(classes[i], s.docked)(s.temps[i]);
+      if(std::isnan(lin)) // Failed read.
+        continue;
+      if(lin > max_lin) {
+        max_lin = lin;
+        t.hottest = int(i);
+      }
+      float room = std::clamp(1.f - lin, 0.f, 1.f);
+      float &h = headroom_[int(classes[i])];
+      if(std::isnan(h) || room < h)
+        h = room;
+    }
+
+    t.raw_percent = to_percent(max_lin);
+    // Don't use the current target percentage, get median of the last few percentages.
+    filter.push(t.raw_percent);
+    t.percent = std::max(filter.median, params_.floor);
+    t.interval = tick_interval(filter.peak, s.battery);
+    return t;
+  }
+
+  // How far a class's hottest sensor is from its curve's high, as of the last
+  // step: 1 at or below low, 0 at or past high. NaN if the class has no sensors.
+  float headroom(sensor_class c) const {
+    return headroom_[int(c)];
+  }
+};
+
+} // namespace fancurve
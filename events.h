@@ -0,0 +1,87 @@
+#pragma once
+
+// Sleep/wake, power source and dock events, and how the control loop
+// reacts to them between ticks. Nothing platform-specific lives here, so a
+// fake SystemEvents can drive it; the real one is MacSystemEvents in fancurve.cc.
+
+#include <functional>
+
+namespace fancurve {
+
+enum class sys_event {
+  none, // Timed out, or interrupted by a signal.
+  will_sleep,
+  did_wake,
+  source_changed, // e.g. AC was plugged in.
+  dock_changed,
+};
+
+/// Where the control loop sleeps between ticks, so that it can notice
+/// the machine going to sleep, changing power source, or being (un)docked.
+class SystemEvents {
+public:
+  virtual ~SystemEvents() = default;
+  // Seconds, on a clock that only has to be consistent with wait().
+  virtual double now() = 0;
+  // Wait up to `seconds` for the next event.
+  virtual sys_event wait(double seconds) = 0;
+  // Let the sleep announced by will_sleep go ahead.
+  virtual void allow_sleep() = 0;
+  virtual bool on_battery() = 0;
+  // Cached; kept up to date by events rather than queried.
+  virtual bool docked() = 0;
+};
+
+/// What the control loop carries from one wait to the next.
+struct loop_state {
+  bool battery;
+  int burst = 0; // Ticks to run back-to-back, without waiting.
+};
+
+// Wait until the next tick is due, `interval` seconds from now, handling
+// events on the way. `manual` takes the fans from the firmware (true) or
+// hands them back (false).
+inline void await_tick(SystemEvents &events, double interval, int window, loop_state &st,
+                       const std::function<void(bool)> &manual) {
+  if(st.burst > 0) {
+    --st.burst;
+    return;
+  }
+
+  bool asleep = false;
+  double deadline = events.now() + interval;
+  for(;;) {
+    double left = asleep ? 1e10 : deadline - events.now();
+    if(left <= 0.)
+      return;
+    switch(events.wait(left)) {
+      case sys_event::none:
+        return;
+      case sys_event::will_sleep:
+        // Suspend sampling, and let the firmware have the fans while we're out.
+        // Only then is it OK for the machine to go to sleep.
+        asleep = true;
+        manual(false);
+        events.allow_sleep();
+        break;
+      case sys_event::did_wake:
+        // Retake the fans right away, and refill the filter with fresh temps.
+        manual(true);
+        st.burst = window - 1;
+        return;
+      case sys_event::source_changed:
+        st.battery = events.on_battery();
+        break;
+      case sys_event::dock_changed:
+        // Switch the skin curve now, and push it through the filter
+        // rather than leaving that to the next few ticks.
+        if(!asleep) {
+          st.burst = window - 1;
+          return;
+        }
+        break;
+    }
+  }
+}
+
+} // namespace fancurve
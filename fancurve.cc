@@ -7,21 +7,59 @@ exec sudo "${0%.*}" "$@"
 #include <map>
 #include <cstdint>
 #include <cstdio>
+#include <ctime>
 #include <csignal>
 #include <cstring>
+#include <cerrno>
 #include <source_location>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <IOKit/IOKitLib.h>
+#include <IOKit/IOMessage.h>
+#include <IOKit/pwr_mgt/IOPMLib.h>
+#include <IOKit/ps/IOPowerSources.h>
+#include <IOKit/ps/IOPSKeys.h>
 #include <CoreGraphics/CoreGraphics.h>
 #include <mach/mach_error.h>
+#include <dispatch/dispatch.h>
 #include <unistd.h>
 
+#include "controller.h"
+#include "events.h"
+#include "sampler.h"
+#include "fancurve.h"
+
 using std::uint8_t;
 using std::uint16_t;
 using std::uint32_t;
 using std::fprintf;
 
+using fancurve::sensor_class;
+using fancurve::sensor_class_count;
+using fancurve::classify;
+using fancurve::curve;
+using fancurve::curve_params;
+using fancurve::Controller;
+using fancurve::targets;
+using fancurve::sys_event;
+using fancurve::SystemEvents;
+using fancurve::loop_state;
+using fancurve::await_tick;
+using fancurve::Sensors;
+using fancurve::FakeSensors;
+using fancurve::Sampler;
+
 extern "C" {
 
 //
@@ -551,6 +589,15 @@ public:
   bool write_int(Key key, int val) {
     return write_(key, val);
   }
+
+  // Every key the SMC has, in index order.
+  std::vector<Key> keys() {
+    std::vector<Key> out;
+    int count = read_int('#KEY');
+    for(int i = 0; i < count; ++i)
+      out.push_back(get_key_from_index(i));
+    return out;
+  }
 };
 
 
@@ -575,9 +622,661 @@ struct fan_info {
   }
 };
 
+// Publish headroom for fancurve_daemon_headroom(), atomically.
+bool write_status(const char *path, const Controller &ctl, int percent) {
+  std::string tmp = std::string(path) + ".tmp";
+  FILE *f = std::fopen(tmp.c_str(), "w");
+  if(!f)
+    return false;
+  fprintf(f, "%ld", (long)std::time(nullptr));
+  for(int c = 0; c < sensor_class_count; ++c)
+    fprintf(f, " %.3f", ctl.headroom(sensor_class(c)));
+  fprintf(f, " %d\n", percent);
+  return std::fclose(f) == 0 && std::rename(tmp.c_str(), path) == 0;
+}
+
 volatile std::sig_atomic_t gSignalStatus;
-void signal_handler(int signal) {
-  gSignalStatus = signal;
+void signal_handler(void *signal) {
+  gSignalStatus = int(std::intptr_t(signal));
+  // Get out of SystemEvents::wait().
+  CFRunLoopStop(CFRunLoopGetMain());
+}
+
+/// SystemEvents from IOKit and CoreGraphics, delivered on the main thread's run loop.
+class MacSystemEvents : public SystemEvents {
+  io_connect_t root_port;
+  IONotificationPortRef notify_port;
+  io_object_t notifier;
+  CFRunLoopSourceRef source_changes;
+  std::deque<sys_event> pending;
+  bool is_docked_;
+  long sleep_id; // To acknowledge the will_sleep we've reported, once it's handled.
+  bool sleep_pending;
+
+  void refresh_docked() {
+    bool now = is_docked();
+    if(now != is_docked_) {
+      is_docked_ = now;
+      pending.push_back(sys_event::dock_changed);
+    }
+  }
+
+  static void on_power(void *ctx, io_service_t, natural_t msg, void *arg) {
+    MacSystemEvents *self = (MacSystemEvents*)ctx;
+    switch(msg) {
+      case kIOMessageCanSystemSleep:
+        IOAllowPowerChange(self->root_port, (long)arg);
+        break;
+      case kIOMessageSystemWillSleep:
+        self->pending.push_back(sys_event::will_sleep);
+        self->sleep_id = (long)arg;
+        self->sleep_pending = true;
+        break;
+      case kIOMessageSystemHasPoweredOn:
+        self->pending.push_back(sys_event::did_wake);
+        // Displays may have come or gone while we were out.
+        self->refresh_docked();
+        break;
+    }
+  }
+
+  static void on_source_change(void *ctx) {
+    MacSystemEvents *self = (MacSystemEvents*)ctx;
+    self->pending.push_back(sys_event::source_changed);
+    // A dock usually powers the laptop too.
+    self->refresh_docked();
+  }
+
+  static void on_display_change(CGDirectDisplayID, CGDisplayChangeSummaryFlags flags, void *ctx) {
+    // Called again once the change is done.
+    if(flags & kCGDisplayBeginConfigurationFlag)
+      return;
+    ((MacSystemEvents*)ctx)->refresh_docked();
+  }
+
+public:
+  MacSystemEvents() : notify_port(nullptr), notifier(IO_OBJECT_NULL), source_changes(nullptr), is_docked_(is_docked()),
+    sleep_id(0), sleep_pending(false) {
+    root_port = IORegisterForSystemPower(this, &notify_port, on_power, &notifier);
+    if(root_port != MACH_PORT_NULL)
+      CFRunLoopAddSource(CFRunLoopGetMain(), IONotificationPortGetRunLoopSource(notify_port), kCFRunLoopDefaultMode);
+    else
+      fprintf(stderr, "IORegisterForSystemPower failed, won't notice sleep.\n");
+    source_changes = IOPSNotificationCreateRunLoopSource(on_source_change, this);
+    if(source_changes)
+      CFRunLoopAddSource(CFRunLoopGetMain(), source_changes, kCFRunLoopDefaultMode);
+    CGDisplayRegisterReconfigurationCallback(on_display_change, this);
+  }
+
+  ~MacSystemEvents() {
+    CGDisplayRemoveReconfigurationCallback(on_display_change, this);
+    if(source_changes) {
+      CFRunLoopSourceInvalidate(source_changes);
+      CFRelease(source_changes);
+    }
+    if(root_port != MACH_PORT_NULL) {
+      IODeregisterForSystemPower(&notifier);
+      IOServiceClose(root_port);
+      IONotificationPortDestroy(notify_port);
+    }
+  }
+
+  double now() override {
+    return CFAbsoluteTimeGetCurrent();
+  }
+
+  void allow_sleep() override {
+    if(sleep_pending)
+      IOAllowPowerChange(root_port, sleep_id);
+    sleep_pending = false;
+  }
+
+  sys_event wait(double seconds) override {
+    CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + seconds;
+    while(pending.empty()) {
+      double left = deadline - CFAbsoluteTimeGetCurrent();
+      if(left <= 0. || CFRunLoopRunInMode(kCFRunLoopDefaultMode, left, true) == kCFRunLoopRunStopped)
+        return sys_event::none;
+    }
+    sys_event e = pending.front();
+    pending.pop_front();
+    return e;
+  }
+
+  bool on_battery() override {
+    CFTypeRef info = IOPSCopyPowerSourcesInfo();
+    if(!info)
+      return false;
+    CFStringRef type = IOPSGetProvidingPowerSourceType(info);
+    bool battery = type && CFStringCompare(type, CFSTR(kIOPMBatteryPowerKey), 0) == kCFCompareEqualTo;
+    CFRelease(info);
+    return battery;
+  }
+
+  bool docked() override {
+    return is_docked_;
+  }
+};
+
+class SMCSensors : public Sensors {
+  SMC own;
+  SMC &smc;
+public:
+  // Borrow a connection, e.g. main()'s, for use on the calling thread.
+  explicit SMCSensors(SMC &shared) : smc(shared) {}
+  // Open a connection of our own.
+  SMCSensors() : smc(own) { own.connect(); }
+  bool connected() const { return smc.connected(); }
+  float read(std::uint32_t key) override { return smc.read_num(key); }
+  // Workers claim keys as they go, so any of them may need any key's info.
+  // Fetch it all now, so it isn't charged to the first parallel probe.
+  void prepare(const std::vector<std::uint32_t> &keys) override {
+    for(SMC::Key key : keys)
+      smc.get_key_info(key);
+  }
+};
+
+
+//
+// Offline tuning: replay recorded traces against candidate curve_params.
+//
+
+/// One tick of a recorded trace, reduced to what the control law looks at.
+/// Within a class, only the hottest sensor can matter.
+struct trace_tick {
+  double time;
+  bool docked;
+  bool battery;
+  int percent; // What the fans were actually set to.
+  float max[sensor_class_count];
+};
+
+// Load a trace written by the "record=" option. Returns false on failure.
+bool load_trace(const char *path, std::vector<trace_tick> &out) {
+  FILE *f = std::fopen(path, "r");
+  if(!f) {
+    fprintf(stderr, "%s: %s\n", path, std::strerror(errno));
+    return false;
+  }
+
+  static const char header[] = "time,docked,battery,percent";
+  constexpr std::size_t header_len = sizeof(header) - 1;
+  std::vector<sensor_class> cols;
+  char line[8192];
+  if(!std::fgets(line, sizeof(line), f) || std::strncmp(line, header, header_len) != 0) {
+    fprintf(stderr, "%s: not a fancurve trace\n", path);
+    std::fclose(f);
+    return false;
+  }
+  for(char *p = line + header_len; *p == ',' && std::strlen(p) >= 5; p += 5)
+    cols.push_back(classify(SMC::Key(p + 1)));
+
+  while(std::fgets(line, sizeof(line), f)) {
+    trace_tick t;
+    int docked, battery, n;
+    if(std::sscanf(line, "%lf,%d,%d,%d%n", &t.time, &docked, &battery, &t.percent, &n) != 4)
+      continue;
+    t.docked = docked;
+    t.battery = battery;
+    std::fill(&t.max[0], &t.max[sensor_class_count], -INFINITY);
+    char *p = line + n;
+    for(sensor_class c : cols) {
+      if(*p != ',')
+        break;
+      char *end;
+      float val = std::strtof(p + 1, &end);
+      p = end;
+      if(val > t.max[int(c)]) // NaN compares false
+        t.max[int(c)] = val;
+    }
+    if(out.empty() || t.time > out.back().time)
+      out.push_back(t);
+  }
+  std::fclose(f);
+  return true;
+}
+
+/// Fans don't change temperatures instantly or completely, so a trace can't
+/// just be replayed open-loop. Model the difference between the candidate
+/// and the recorded fan speed as a first-order lag on every sensor.
+struct thermal_model {
+  float gain = 10.; // degC difference between 0% and 99% fan, at steady state.
+  float tau = 60.; // Seconds.
+};
+
+struct score {
+  double fan_seconds; // Integral of fan speed, 0-1.
+  double over_seconds; // Time any sensor was past the default curve's high.
+};
+
+// Run main()'s control law over a trace.
+score replay(const curve_params &p, const thermal_model &m, const std::vector<trace_tick> &trace) {
+  const curve_params limits;
+  score s = {0., 0.};
+  if(trace.size() < 2)
+    return s;
+
+  // Within a class, only the hottest sensor can matter.
+  Controller ctl(p, {sensor_class::hot, sensor_class::warm, sensor_class::skin, sensor_class::other});
+  double t = trace.front().time;
+  double end = trace.back().time;
+  double offset = 0.; // How much hotter the sensors are than what was recorded.
+  size_t i = 0;
+  while(t < end) {
+    while(i + 1 < trace.size() && trace[i + 1].time <= t)
+      ++i;
+    const trace_tick &k = trace[i];
+
+    float temps[sensor_class_count];
+    bool over = false;
+    for(int c = 0; c < sensor_class_count; ++c) {
+      temps[c] = k.max[c] + offset;
+      if(temps[c] > limits(sensor_class(c), k.docked).high)
+        over = true;
+    }
+
+    targets tg = ctl.step({temps, k.docked, k.battery});
+    int percent = tg.percent;
+
+    double dt = std::min(tg.interval / 1e6, end - t);
+    s.fan_seconds += percent/99. * dt;
+    if(over)
+      s.over_seconds += dt;
+    offset += (m.gain * (k.percent - percent)/99. - offset) * (1. - std::exp(-dt / m.tau));
+    t += dt;
+  }
+  return s;
+}
+
+// Deterministically generate the idx'th candidate. Candidate 0 is the default.
+curve_params candidate(std::uint64_t seed, std::size_t idx) {
+  curve_params p;
+  if(idx == 0)
+    return p;
+  std::mt19937_64 rng(seed ^ (idx * 0x9E3779B97F4A7C15ull));
+  // Temps are on a half degree grid so the output is readable.
+  auto pick = [&](float lo, float hi) {
+    return std::uniform_int_distribution<int>(int(lo*2), int(hi*2))(rng) / 2.f;
+  };
+  auto pick_curve = [&](curve &c, float low_lo, float low_hi, float width_lo, float width_hi) {
+    c.low = pick(low_lo, low_hi);
+    c.high = c.low + pick(width_lo, width_hi);
+  };
+  pick_curve(p.hot, 70., 92., 6., 20.);
+  pick_curve(p.warm, 55., 75., 6., 20.);
+  pick_curve(p.skin_docked, 36., 44., 2., 10.);
+  pick_curve(p.skin, 32., 40., 2., 8.);
+  pick_curve(p.other, 50., 68., 4., 16.);
+  p.floor = std::uniform_int_distribution<int>(0, 68)(rng);
+  p.window = std::uniform_int_distribution<int>(1, 9)(rng);
+  return p;
+}
+
+int tune(int argc, char *argv[]) {
+  std::vector<std::vector<trace_tick>> traces;
+  thermal_model model;
+  std::size_t samples = 100'000;
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  std::uint64_t seed = 1;
+
+  for(int i = 0; i < argc; i++) {
+    if(std::sscanf(argv[i], "samples=%zu", &samples) == 1) continue;
+    if(std::sscanf(argv[i], "threads=%u", &threads) == 1) continue;
+    if(std::sscanf(argv[i], "seed=%llu", (unsigned long long*)&seed) == 1) continue;
+    if(std::sscanf(argv[i], "gain=%f", &model.gain) == 1) continue;
+    if(std::sscanf(argv[i], "tau=%f", &model.tau) == 1) continue;
+    traces.emplace_back();
+    if(!load_trace(argv[i], traces.back()))
+      return 1;
+  }
+  if(traces.empty()) {
+    fprintf(stderr, "usage: fancurve tune TRACE... [samples=N] [threads=N] [seed=N] [gain=degC] [tau=sec]\n");
+    return 1;
+  }
+  samples = std::max<std::size_t>(samples, 1);
+  threads = std::max(threads, 1u);
+
+  // Workers pull small chunks off a shared counter, so a slow chunk
+  // (e.g. a long window) doesn't hold up the rest of the pool.
+  std::vector<score> scores(samples);
+  std::atomic<std::size_t> next = 0;
+  constexpr std::size_t chunk = 64;
+  auto work = [&]() {
+    for(;;) {
+      std::size_t begin = next.fetch_add(chunk);
+      if(begin >= samples)
+        return;
+      for(std::size_t idx = begin; idx < std::min(begin + chunk, samples); ++idx) {
+        curve_params p = candidate(seed, idx);
+        score s = {0., 0.};
+        for(const std::vector<trace_tick> &trace : traces) {
+          score r = replay(p, model, trace);
+          s.fan_seconds += r.fan_seconds;
+          s.over_seconds += r.over_seconds;
+        }
+        scores[idx] = s;
+      }
+    }
+  };
+  std::vector<std::thread> pool;
+  for(unsigned i = 1; i < threads; ++i)
+    pool.emplace_back(work);
+  work();
+  for(std::thread &t : pool)
+    t.join();
+
+  // Pareto front: sort by fan time, then keep whatever improves on over-temp time.
+  std::vector<std::size_t> order(samples);
+  for(std::size_t i = 0; i < samples; ++i)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+    if(scores[a].fan_seconds != scores[b].fan_seconds)
+      return scores[a].fan_seconds < scores[b].fan_seconds;
+    return scores[a].over_seconds < scores[b].over_seconds;
+  });
+
+  printf("# default: fan %.1f s, over %.1f s\n", scores[0].fan_seconds, scores[0].over_seconds);
+  printf("# fan_s over_s params\n");
+  double best_over = INFINITY;
+  for(std::size_t idx : order) {
+    if(!(scores[idx].over_seconds < best_over))
+      continue;
+    best_over = scores[idx].over_seconds;
+    printf("%.1f %.1f ", scores[idx].fan_seconds, scores[idx].over_seconds);
+    candidate(seed, idx).print(stdout);
+    printf("\n");
+  }
+  return 0;
+}
+
+
+//
+// Sampler benchmark, against a fake backend.
+//
+
+
+int bench(int argc, char *argv[]) {
+  unsigned latency = 50; // us per read
+  unsigned sensors = 80;
+  unsigned threads = 4;
+  unsigned ticks = 50;
+  bool serialize = false;
+
+  for(int i = 0; i < argc; i++) {
+    if(std::sscanf(argv[i], "latency=%u", &latency) == 1) continue;
+    if(std::sscanf(argv[i], "sensors=%u", &sensors) == 1) continue;
+    if(std::sscanf(argv[i], "threads=%u", &threads) == 1) continue;
+    if(std::sscanf(argv[i], "ticks=%u", &ticks) == 1) continue;
+    if(std::strcmp(argv[i], "serialize") == 0) {
+      serialize = true;
+      continue;
+    }
+    fprintf(stderr, "usage: fancurve bench [latency=us] [sensors=N] [threads=N] [ticks=N] [serialize]\n");
+    return 1;
+  }
+  threads = std::max(threads, 1u);
+  ticks = std::max(ticks, 1u);
+
+  std::mutex driver;
+  std::vector<std::uint32_t> keys;
+  for(unsigned i = 0; i < sensors; ++i)
+    keys.push_back('TC\x00\x00' | i);
+  std::vector<std::unique_ptr<Sensors>> backends;
+  for(unsigned i = 0; i < threads; ++i)
+    backends.push_back(std::make_unique<FakeSensors>(latency, serialize ? &driver : nullptr));
+  Sampler sampler(std::move(keys), std::move(backends));
+  std::vector<float> snapshot(sampler.size());
+
+  auto time = [&](auto &&f) {
+    auto t0 = std::chrono::steady_clock::now();
+    for(unsigned i = 0; i < ticks; ++i)
+      f();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count() / ticks;
+  };
+  double serial = time([&]{ sampler.sample_serial(snapshot.data()); });
+  double parallel = time([&]{ sampler.sample_parallel(snapshot.data()); });
+  for(unsigned i = 0; i < Sampler::probe_ticks; ++i)
+    sampler.sample(snapshot.data());
+
+  printf("%u sensors, %u us/read, %u threads%s\n", sensors, latency, threads, serialize ? ", serialized" : "");
+  printf("serial:   %8.3f ms/tick\n", serial);
+  printf("parallel: %8.3f ms/tick (%.2fx)\n", parallel, serial / parallel);
+  printf("sampler picks: %s\n", sampler.parallel() ? "parallel" : "serial");
+  return 0;
+}
+
+
+//
+// Snapshots of the whole SMC key space, for poking at new hardware.
+//
+
+/// Every readable key's raw value at one moment.
+struct key_snapshot {
+  struct entry {
+    std::uint32_t key;
+    std::uint32_t type;
+    std::uint8_t size;
+    std::uint8_t bytes[32];
+
+    bool same_value(const entry &o) const {
+      return type == o.type && size == o.size && std::memcmp(bytes, o.bytes, size) == 0;
+    }
+  };
+  std::vector<entry> entries; // Sorted by key.
+
+  static constexpr char magic[8] = {'F', 'C', 'S', 'N', 'A', 'P', '1', '\0'};
+
+  // Read every key in `keys`. Key info comes from smc's cache, so only the
+  // first capture with a given SMC pays for the info lookups.
+  void capture(SMC &smc, const std::vector<SMC::Key> &keys) {
+    entries.clear();
+    for(SMC::Key key : keys) {
+      SMCParamStruct out = SMCParamStructZero;
+      const SMCKeyInfoData *info = smc.get_key_info(key);
+      if(!info || info->dataSize > 32 || !smc.read(key, &out))
+        continue;
+      entry e;
+      e.key = key;
+      e.type = info->dataType;
+      e.size = info->dataSize;
+      std::memcpy(e.bytes, out.bytes, sizeof(e.bytes));
+      entries.push_back(e);
+    }
+    std::sort(entries.begin(), entries.end(), [](const entry &a, const entry &b) { return a.key < b.key; });
+  }
+
+  // Format: magic, then per entry big-endian key and type, a size byte, and `size` raw bytes.
+  bool save(const char *path) const {
+    FILE *f = std::fopen(path, "wb");
+    if(!f) {
+      fprintf(stderr, "%s: %s\n", path, std::strerror(errno));
+      return false;
+    }
+    std::fwrite(magic, 1, sizeof(magic), f);
+    for(const entry &e : entries) {
+      uint8_t head[9];
+      to_int(e.key, &head[0]);
+      to_int(e.type, &head[4]);
+      head[8] = e.size;
+      std::fwrite(head, 1, sizeof(head), f);
+      std::fwrite(e.bytes, 1, e.size, f);
+    }
+    bool ok = !std::ferror(f);
+    return std::fclose(f) == 0 && ok;
+  }
+
+  bool load(const char *path) {
+    FILE *f = std::fopen(path, "rb");
+    if(!f) {
+      fprintf(stderr, "%s: %s\n", path, std::strerror(errno));
+      return false;
+    }
+    char m[sizeof(magic)];
+    if(std::fread(m, 1, sizeof(m), f) != sizeof(m) || std::memcmp(m, magic, sizeof(m)) != 0) {
+      fprintf(stderr, "%s: not a fancurve snapshot\n", path);
+      std::fclose(f);
+      return false;
+    }
+    entries.clear();
+    uint8_t head[9];
+    const char *error = nullptr;
+    for(;;) {
+      std::size_t n = std::fread(head, 1, sizeof(head), f);
+      if(n == 0 && std::feof(f))
+        break; // Only a clean end between entries is the end of the snapshot.
+      entry e = {};
+      e.key = as_int<std::uint32_t>(&head[0]);
+      e.type = as_int<std::uint32_t>(&head[4]);
+      e.size = head[8];
+      if(n == sizeof(head) && e.size > sizeof(e.bytes)) {
+        error = "corrupt snapshot";
+        break;
+      }
+      if(n != sizeof(head) || std::fread(e.bytes, 1, e.size, f) != e.size) {
+        error = std::ferror(f) ? std::strerror(errno) : "truncated snapshot";
+        break;
+      }
+      entries.push_back(e);
+    }
+    std::fclose(f);
+    if(error) {
+      fprintf(stderr, "%s: %s\n", path, error);
+      entries.clear();
+      return false;
+    }
+    std::sort(entries.begin(), entries.end(), [](const entry &a, const entry &b) { return a.key < b.key; });
+    return true;
+  }
+};
+
+// Print a value as a number if we know how, otherwise as hex.
+void print_value(FILE *f, const key_snapshot::entry &e) {
+  if(smc_type(e.type) == smc_type::ch8) {
+    fprintf(f, "\"");
+    for(int i = 0; i < e.size && e.bytes[i]; ++i)
+      fprintf(f, "%c", e.bytes[i] >= ' ' && e.bytes[i] < 0x7F && e.bytes[i] != '"' ? e.bytes[i] : '?');
+    fprintf(f, "\"");
+    return;
+  }
+  double val = e.size ? as_num(e.type, e.bytes) : NAN;
+  if(!std::isnan(val)) {
+    fprintf(f, "%g", val);
+    return;
+  }
+  for(int i = 0; i < e.size; ++i)
+    fprintf(f, "%02x", e.bytes[i]);
+}
+
+void print_key(FILE *f, std::uint32_t k) {
+  SMC::Key key(k);
+  fprintf(f, "%c%c%c%c", key[0], key[1], key[2], key[3]);
+}
+
+void print_csv(FILE *f, const key_snapshot &s) {
+  fprintf(f, "key,type,size,raw,value\n");
+  for(const key_snapshot::entry &e : s.entries) {
+    print_key(f, e.key);
+    fprintf(f, ",");
+    print_key(f, e.type);
+    fprintf(f, ",%d,", e.size);
+    for(int i = 0; i < e.size; ++i)
+      fprintf(f, "%02x", e.bytes[i]);
+    fprintf(f, ",");
+    print_value(f, e);
+    fprintf(f, "\n");
+  }
+}
+
+// Print the keys that were added, removed, or changed from a to b.
+// Both are sorted, so this is one merge pass.
+void print_diff(FILE *f, const key_snapshot &a, const key_snapshot &b) {
+  auto line = [&](char tag, const key_snapshot::entry &e) {
+    fprintf(f, "%c ", tag);
+    print_key(f, e.key);
+    fprintf(f, " ");
+    print_key(f, e.type);
+    fprintf(f, " ");
+    print_value(f, e);
+  };
+  auto i = a.entries.begin(), j = b.entries.begin();
+  while(i != a.entries.end() || j != b.entries.end()) {
+    if(j == b.entries.end() || (i != a.entries.end() && i->key < j->key)) {
+      line('-', *i++);
+      fprintf(f, "\n");
+    }
+    else if(i == a.entries.end() || j->key < i->key) {
+      line('+', *j++);
+      fprintf(f, "\n");
+    }
+    else {
+      if(!i->same_value(*j)) {
+        line(' ', *i);
+        fprintf(f, " -> ");
+        print_value(f, *j);
+        double d = as_num(j->type, j->bytes) - as_num(i->type, i->bytes);
+        if(i->type == j->type && !std::isnan(d))
+          fprintf(f, " (%+g)", d);
+        fprintf(f, "\n");
+      }
+      ++i, ++j;
+    }
+  }
+}
+
+int snapshot(int argc, char *argv[]) {
+  if(argc == 2 && std::strcmp(argv[0], "csv") == 0) {
+    key_snapshot s;
+    if(!s.load(argv[1]))
+      return 1;
+    print_csv(stdout, s);
+    return 0;
+  }
+  if(argc != 1) {
+    fprintf(stderr, "usage: fancurve snapshot FILE\n       fancurve snapshot csv FILE\n");
+    return 1;
+  }
+
+  SMC smc;
+  smc.connect();
+  if(!smc.connected())
+    return -1;
+  key_snapshot s;
+  s.capture(smc, smc.keys());
+  if(!s.save(argv[0]))
+    return 1;
+  fprintf(stderr, "%zu keys\n", s.entries.size());
+  return 0;
+}
+
+int diff(int argc, char *argv[]) {
+  double interval;
+  if(argc == 2) {
+    key_snapshot a, b;
+    if(!a.load(argv[0]) || !b.load(argv[1]))
+      return 1;
+    print_diff(stdout, a, b);
+    return 0;
+  }
+  if(argc != 1 || std::sscanf(argv[0], "interval=%lf", &interval) != 1 || !(interval > 0.)) {
+    fprintf(stderr, "usage: fancurve diff OLD NEW\n       fancurve diff interval=SECONDS\n");
+    return 1;
+  }
+
+  SMC smc;
+  smc.connect();
+  if(!smc.connected())
+    return -1;
+  std::vector<SMC::Key> keys = smc.keys();
+  key_snapshot prev, cur;
+  prev.capture(smc, keys);
+  for(;;) {
+    usleep(useconds_t(interval * 1e6));
+    cur.capture(smc, keys);
+    print_diff(stdout, prev, cur);
+    printf("--\n");
+    fflush(stdout);
+    std::swap(prev, cur);
+  }
 }
 
 } // namespace
@@ -598,31 +1297,79 @@ int main(int argc, char *argv[]) {
 #endif
 
 int main(int argc, char *argv[]) {
+  if(argc > 1 && std::strcmp(argv[1], "tune") == 0)
+    return tune(argc - 2, argv + 2);
+  if(argc > 1 && std::strcmp(argv[1], "bench") == 0)
+    return bench(argc - 2, argv + 2);
+  if(argc > 1 && std::strcmp(argv[1], "snapshot") == 0)
+    return snapshot(argc - 2, argv + 2);
+  if(argc > 1 && std::strcmp(argv[1], "diff") == 0)
+    return diff(argc - 2, argv + 2);
+
   SMC smc;
   smc.connect();
   if(!smc.connected())
     return -1;
 
+  // Signals are handled on the main queue, which the run loop in
+  // SystemEvents::wait() services.
   gSignalStatus = 0;
-  std::signal(SIGINT, signal_handler);
-  std::signal(SIGTERM, signal_handler);
+  for(int sig : {SIGINT, SIGTERM}) {
+    std::signal(sig, SIG_IGN);
+    dispatch_source_t src = dispatch_source_create(DISPATCH_SOURCE_TYPE_SIGNAL, sig, 0, dispatch_get_main_queue());
+    dispatch_set_context(src, (void*)std::intptr_t(sig));
+    dispatch_source_set_event_handler_f(src, signal_handler);
+    dispatch_resume(src);
+  }
 
   bool tty = isatty(fileno(stderr));
   bool templog = tty; // Write out the temps to the terminal.
-  bool raise_floor = false; // Keep fans at least 68% high.
   bool dry = false; // No SMC writes. Won't require root.
+  curve_params params;
+  const char *record = nullptr; // Where to write per-tick temps, for "fancurve tune".
+  unsigned threads = 1; // SMC connections to sample with.
+  const char *status = nullptr; // Headroom, for fancurve_daemon_headroom().
+  bool status_given = false;
 
   for(int i = 1; i < argc; i++) {
     if(std::strcmp(argv[i], "log") == 0)
       templog = true;
-    if(std::strcmp(argv[i], "nolog") == 0)
+    else if(std::strcmp(argv[i], "nolog") == 0)
       templog = false;
-    if(std::strcmp(argv[i], "high") == 0)
-      raise_floor = true;
-    if(std::strcmp(argv[i], "dry") == 0)
+    else if(std::strcmp(argv[i], "high") == 0)
+      params.floor = 68; // Keep fans at least 68% high.
+    else if(std::strcmp(argv[i], "dry") == 0)
       dry = true;
+    else if(std::strncmp(argv[i], "record=", 7) == 0)
+      record = argv[i] + 7;
+    else if(std::strncmp(argv[i], "status=", 7) == 0) {
+      status = argv[i][7] ? argv[i] + 7 : nullptr;
+      status_given = true;
+    }
+    else if(std::sscanf(argv[i], "threads=%u", &threads) == 1) {
+      threads = std::clamp(threads, 1u, 16u);
+    }
+    else if(std::strchr(argv[i], '=') && !params.parse(argv[i])) {
+      fprintf(stderr, "Bad parameter: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  // Traces say what the fans were set to, which a dry run doesn't know.
+  if(record && dry) {
+    fprintf(stderr, "Can't record a trace in a dry run.\n");
+    return 1;
+  }
+  FILE *trace = nullptr;
+  if(record && !(trace = std::fopen(record, "w"))) {
+    fprintf(stderr, "%s: %s\n", record, std::strerror(errno));
+    return 1;
   }
 
+  // The default path needs root, which dry runs shouldn't.
+  if(!status_given && !dry)
+    status = FANCURVE_STATUS_PATH;
+
   std::vector<SMC::Key> hot;
   std::vector<SMC::Key> warm;
   std::vector<SMC::Key> skin;
@@ -632,42 +1379,16 @@ int main(int argc, char *argv[]) {
   //
   // Discover the SMC keys for temps and fans.
   //
-  int keys = smc.read_int('#KEY');
-  for(int i = 0; i < keys; ++i) {
-    SMC::Key key = smc.get_key_from_index(i);
+  for(SMC::Key key : smc.keys()) {
     if(key[0] == 'T') {
       const SMCKeyInfoData *info = smc.get_key_info(key);
       if(is_float(smc_type(info->dataType))) {
         // Temperature sensor
-        if(key[1] == 's') {
-          // "skin" sensor, for the case.
-          skin.push_back(key);
-        }
-        else if(key[1] == 'C' && key[3] != 'P') {
-          // This includes CPU cores and other on-die sensors
-          // that run hotter than the rest of the board.
-          hot.push_back(key);
-        }
-        else if(key[1] == 'G' && key[3] != 'P') {
-          // GPU sensors (that aren't proximity).
-          hot.push_back(key);
-        }
-        else if(key[1] == 'T' && (key[2] == 'L' || key[2] == 'R') && key[3] == 'D') {
-          // Thunderbolt ports.
-          // Maybe this should just be the same as the cold other sensors,
-          // but this was what was generally setting off my fans when docked
-          // so I want to try letting them get warmer.
-          warm.push_back(key);
-        }
-        else if(key[1] == 'P' && key[2] == 'C' && key[3] == 'D') {
-          // PCH
-          // Same deal, this is what is generally tripping the fans, and is
-          // fine to be hotter. I'd say 80 degC is on the high end of fine,
-          // and that's where the "warm" curve maxes out. So, perfect.
-          warm.push_back(key);
-        }
-        else {
-          other.push_back(key);
+        switch(classify(key)) {
+          case sensor_class::hot: hot.push_back(key); break;
+          case sensor_class::warm: warm.push_back(key); break;
+          case sensor_class::skin: skin.push_back(key); break;
+          case sensor_class::other: other.push_back(key); break;
         }
       }
     }
@@ -721,43 +1442,50 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  float max_lin;
-  SMC::Key max_key = 0;
-  float max_val;
+  // All the temps are read up front, in this order.
+  std::vector<SMC::Key> sensors;
+  std::vector<sensor_class> classes;
+  for(const std::vector<SMC::Key> *v : {&hot, &warm, &skin, &other}) {
+    sensors.insert(sensors.end(), v->begin(), v->end());
+    for(SMC::Key k : *v)
+      classes.push_back(classify(k));
+  }
+  std::vector<std::unique_ptr<Sensors>> backends;
+  backends.push_back(std::make_unique<SMCSensors>(smc));
+  for(unsigned i = 1; i < threads; ++i) {
+    auto s = std::make_unique<SMCSensors>();
+    if(s->connected())
+      backends.push_back(std::move(s));
+  }
+  Sampler sampler({sensors.begin(), sensors.end()}, std::move(backends));
+  std::vector<float> temps(sensors.size());
 
-  auto mu = [&](float low, float high, SMC::Key k){
-    float val = smc.read_num(k);
-    float lin = (val - low) / (high - low);
-    if(lin > max_lin) {
-      max_lin = lin;
-      max_key = k;
-      max_val = val;
-    }
+  Controller ctl(params, std::move(classes));
+  int counter = 0;
+  MacSystemEvents events;
+  loop_state loop = {events.on_battery()};
+  auto manual = [&](bool on) {
+    if(!dry) for(fan_info &fan : fans)
+      smc.write_int(fan.Md(), on);
   };
 
-  char roll[3] = {99, 99, 99}; // fans will start maxed as a "hello, it's working"
-  int counter = 0;
+  if(trace) {
+    fprintf(trace, "time,docked,battery,percent");
+    for(SMC::Key k : sensors)
+      fprintf(trace, ",%c%c%c%c", k[0], k[1], k[2], k[3]);
+    fprintf(trace, "\n");
+  }
+  timespec start;
+  clock_gettime(CLOCK_UPTIME_RAW, &start);
+
   if(templog && tty)
     fprintf(stderr, "\033[K\n\033[K\n\033[K\n\033[K\n\033[K\n\033[K\n\033[K\n\033[K\n\033[K\n\033[K\n\033[K\033[10A");
   while(gSignalStatus == 0) {
-    max_lin = -INFINITY;
-    max_key = 0;
-    max_val = 0.0;
-    // It's possible that "hot" should be changed to MUCH hotter.
-    // This is because it's not like turning the fans up does much to
-    // change on-die temperatures, when we're already keeping the
-    // heatsinks and finstacks cool.
-    // Let's try it.
-    //for(SMC::Key k : hot) mu(69., 83., k);
-    for(SMC::Key k : hot) mu(82., 96., k);
-    for(SMC::Key k : warm) mu(65., 79., k);
-    for(SMC::Key k : skin) is_docked() ? mu(40., 45., k) : mu(36., 40., k);
-    for(SMC::Key k : other) mu(60., 70., k);
-
-    // actually only goes to 99
-    int percent = max_lin >= 0.99 ? 99
-                : max_lin <= 0.0 ? 0
-                : int(99*(max_lin + 0.01));
+    bool docked = events.docked();
+    sampler.sample(temps.data());
+    targets tg = ctl.step({temps.data(), docked, loop.battery});
+    SMC::Key max_key = tg.hottest >= 0 ? sensors[tg.hottest] : SMC::Key(0);
+    float max_val = tg.hottest >= 0 ? temps[tg.hottest] : 0.f;
 
     if(++counter >= 11) {
       counter = 1;
@@ -769,27 +1497,36 @@ int main(int argc, char *argv[]) {
     }
     // Print the target fan percentage value and the "hottest" sensor responsible for it.
     if(templog)
-      fprintf(stderr, "%02d%% %6.2f %c%c%c%c\n%s", percent, max_val, max_key[0], max_key[1], max_key[2], max_key[3], (tty?"\033[K":""));
-
-    // Don't use the current target percentage, get median of the last 3 percentages.
-    // This is mostly because cpu core temps (TC%dC) are spiky.
-    roll[0] = roll[1];
-    roll[1] = roll[2];
-    roll[2] = percent;
-    char sorted[3] = {roll[0], roll[1], roll[2]};
-    std::sort(&sorted[0], &sorted[3]);
-    percent = sorted[1];
-
-    if(raise_floor && percent < 68)
-      percent = 68;
+      fprintf(stderr, "%02d%% %6.2f %c%c%c%c\n%s", tg.raw_percent, max_val, max_key[0], max_key[1], max_key[2], max_key[3], (tty?"\033[K":""));
+
+    int percent = tg.percent;
     if(!dry) for(fan_info &fan : fans)
       smc.write_num(fan.Tg(), percent/99.f * (fan.max - fan.min) + fan.min);
 
-    // Sleep 2-7 seconds; updates come slower when temps are cool.
-    // FWIW: 3 second update interval was giving (sys+user)/real = 0.1%
-    usleep(2'000'000 + int(5'000'000 * (1. - sorted[2]/99.)));
+    if(trace) {
+      timespec now;
+      clock_gettime(CLOCK_UPTIME_RAW, &now);
+      fprintf(trace, "%.3f,%d,%d,%d", (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9, docked, loop.battery, percent);
+      for(float v : temps)
+        fprintf(trace, ",%.2f", v);
+      fprintf(trace, "\n");
+      fflush(trace);
+    }
+
+    if(status && !write_status(status, ctl, percent)) {
+      fprintf(stderr, "%s: %s\n", status, std::strerror(errno));
+      status = nullptr;
+    }
+
+    // Wait for the next tick, or for the machine to do something.
+    await_tick(events, tg.interval / 1e6, params.window, loop, manual);
   }
 
+  if(trace)
+    std::fclose(trace);
+  if(status)
+    unlink(status);
+
   if(!dry) for(fan_info &fan : fans)
     smc.write_int(fan.Md(), 0);
 
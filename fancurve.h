@@ -0,0 +1,72 @@
+#ifndef FANCURVE_H
+#define FANCURVE_H
+
+/*
+ * C API for fancurve's control law, and for asking a running fancurve
+ * daemon how much thermal headroom the machine has left.
+ *
+ * Build the library with:
+ *   c++ -std=c++20 -dynamiclib ./libfancurve.cc -o ./libfancurve.dylib
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Where the daemon publishes its status after every tick. */
+#define FANCURVE_STATUS_PATH "/var/run/net.clockish.fancurve.status"
+
+enum fancurve_class {
+  FANCURVE_HOT,
+  FANCURVE_WARM,
+  FANCURVE_SKIN,
+  FANCURVE_OTHER,
+  FANCURVE_CLASS_COUNT
+};
+
+/*
+ * Headroom is how far the hottest sensor in a class is from its curve's
+ * high: 1 at or below the curve's low, 0 at or past its high (fans maxed).
+ * NaN for classes with no sensors.
+ */
+
+typedef struct fancurve_controller fancurve_controller;
+
+typedef struct {
+  int percent;     /* Fan speed to set, 0-99. */
+  int hottest;     /* Index of the sensor responsible, or -1. */
+  double interval; /* Seconds to wait before the next step. */
+} fancurve_targets;
+
+/* Which class an SMC temperature key, e.g. "TC0C", belongs to. */
+int fancurve_classify(const char key[4]);
+
+/*
+ * Make a controller for n sensors, named by their SMC keys.
+ * params is NULL or space separated "name=value" pairs, as the daemon takes
+ * on its command line, e.g. "hot=82:96 floor=20".
+ * Returns NULL if params is malformed or on allocation failure.
+ */
+fancurve_controller *fancurve_controller_new(const char *const keys[], size_t n, const char *params);
+void fancurve_controller_free(fancurve_controller *c);
+
+/* Run one tick. temps has one entry per key, NaN for failed reads. Doesn't allocate. */
+fancurve_targets fancurve_controller_step(fancurve_controller *c, const float *temps, int docked, int battery);
+
+/* Headroom per class as of the last step. */
+void fancurve_controller_headroom(const fancurve_controller *c, float headroom[FANCURVE_CLASS_COUNT]);
+
+/*
+ * Headroom per class from the running daemon.
+ * Returns 0 on success, or -1 if the daemon isn't running or its status is
+ * older than max_age seconds.
+ */
+int fancurve_daemon_headroom(float headroom[FANCURVE_CLASS_COUNT], double max_age);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // FANCURVE_H
@@ -0,0 +1,91 @@
+#include "fancurve.h"
+#include "controller.h"
+
+#include <new>
+#include <string>
+#include <ctime>
+
+using fancurve::Controller;
+using fancurve::curve_params;
+using fancurve::sensor_class;
+
+struct fancurve_controller {
+  Controller ctl;
+};
+
+static_assert(int(sensor_class::hot) == FANCURVE_HOT);
+static_assert(int(sensor_class::warm) == FANCURVE_WARM);
+static_assert(int(sensor_class::skin) == FANCURVE_SKIN);
+static_assert(int(sensor_class::other) == FANCURVE_OTHER);
+static_assert(fancurve::sensor_class_count == FANCURVE_CLASS_COUNT);
+
+namespace {
+
+std::uint32_t key_of(const char name[4]) {
+  return ((std::uint32_t)(unsigned char)name[0] << 24)
+    | ((std::uint32_t)(unsigned char)name[1] << 16)
+    | ((std::uint32_t)(unsigned char)name[2] << 8)
+    | ((std::uint32_t)(unsigned char)name[3] << 0);
+}
+
+} // namespace
+
+extern "C" {
+
+int fancurve_classify(const char key[4]) {
+  return int(fancurve::classify(key_of(key)));
+}
+
+fancurve_controller *fancurve_controller_new(const char *const keys[], size_t n, const char *params) {
+  try {
+    curve_params p;
+    if(params) {
+      std::string s(params);
+      for(std::size_t i = 0, j; i < s.size(); i = j + 1) {
+        j = s.find(' ', i);
+        if(j == std::string::npos)
+          j = s.size();
+        if(j > i && !p.parse(s.substr(i, j - i).c_str()))
+          return nullptr;
+      }
+    }
+    std::vector<sensor_class> classes;
+    for(std::size_t i = 0; i < n; ++i)
+      classes.push_back(fancurve::classify(key_of(keys[i])));
+    return new fancurve_controller{Controller(p, std::move(classes))};
+  }
+  catch(const std::bad_alloc &) {
+    return nullptr;
+  }
+}
+
+void fancurve_controller_free(fancurve_controller *c) {
+  delete c;
+}
+
+fancurve_targets fancurve_controller_step(fancurve_controller *c, const float *temps, int docked, int battery) {
+  fancurve::targets t = c->ctl.step({temps, docked != 0, battery != 0});
+  return {t.percent, t.hottest, t.interval / 1e6};
+}
+
+void fancurve_controller_headroom(const fancurve_controller *c, float headroom[FANCURVE_CLASS_COUNT]) {
+  for(int i = 0; i < FANCURVE_CLASS_COUNT; ++i)
+    headroom[i] = c->ctl.headroom(sensor_class(i));
+}
+
+int fancurve_daemon_headroom(float headroom[FANCURVE_CLASS_COUNT], double max_age) {
+  FILE *f = std::fopen(FANCURVE_STATUS_PATH, "r");
+  if(!f)
+    return -1;
+  double time;
+  float h[FANCURVE_CLASS_COUNT];
+  int n = std::fscanf(f, "%lf %f %f %f %f", &time, &h[0], &h[1], &h[2], &h[3]);
+  std::fclose(f);
+  if(n != 1 + FANCURVE_CLASS_COUNT || !(std::time(nullptr) - time <= max_age))
+    return -1;
+  for(int i = 0; i < FANCURVE_CLASS_COUNT; ++i)
+    headroom[i] = h[i];
+  return 0;
+}
+
+} // extern "C"
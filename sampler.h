@@ -0,0 +1,168 @@
+#pragma once
+
+// Reading a tick's worth of sensors, serially or across worker threads.
+// Nothing platform-specific lives here; the SMC backend is SMCSensors in fancurve.cc.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+namespace fancurve {
+
+/// Something that can read temperatures.
+/// Sampler workers each get their own, since SMC connections are per-caller.
+/// Keys are SMC keys, e.g. 'TC0C'.
+class Sensors {
+public:
+  virtual ~Sensors() = default;
+  virtual float read(std::uint32_t key) = 0;
+  // Called once with every key this may be asked to read, before any reads.
+  virtual void prepare(const std::vector<std::uint32_t> &) {}
+};
+
+/// Sensors that just take a while to answer.
+class FakeSensors : public Sensors {
+  useconds_t latency;
+  std::mutex *driver; // If set, calls are serialized, as if by the driver.
+public:
+  FakeSensors(useconds_t latency, std::mutex *driver) : latency(latency), driver(driver) {}
+  float read(std::uint32_t key) override {
+    if(driver) {
+      std::lock_guard<std::mutex> lock(*driver);
+      usleep(latency);
+    } else {
+      usleep(latency);
+    }
+    return 40.f + (key & 0xF);
+  }
+};
+
+/// Reads a fixed list of sensors into a snapshot, once per tick.
+///
+/// With more than one backend, the keys are split across worker threads.
+/// Keys are claimed one at a time off a shared counter, so a worker that
+/// gets stuck on a slow read doesn't hold up the rest of the tick.
+/// Whether that's actually faster depends on whether the driver serializes
+/// calls, so both ways are timed every so often and the faster one is used.
+class Sampler {
+  std::vector<std::uint32_t> keys;
+  std::vector<std::unique_ptr<Sensors>> backends; // [0] is used by the calling thread.
+  std::vector<std::thread> workers;
+
+  std::mutex mtx;
+  std::condition_variable start_cv;
+  std::condition_variable done_cv;
+  std::uint64_t generation = 0;
+  std::size_t running = 0;
+  bool quit = false;
+  std::atomic<std::size_t> next = 0;
+  float *out = nullptr;
+
+  unsigned tick = 0;
+  std::chrono::steady_clock::duration serial_time{}, parallel_time{};
+  bool use_parallel = false;
+
+  void work(Sensors &s) {
+    for(std::size_t i; (i = next.fetch_add(1)) < keys.size(); )
+      out[i] = s.read(keys[i]);
+  }
+
+  void worker(Sensors &s) {
+    std::uint64_t seen = 0;
+    for(;;) {
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        start_cv.wait(lock, [&]{ return quit || generation != seen; });
+        if(quit)
+          return;
+        seen = generation;
+      }
+      work(s);
+      std::lock_guard<std::mutex> lock(mtx);
+      if(--running == 0)
+        done_cv.notify_one();
+    }
+  }
+
+public:
+  static constexpr unsigned probe_period = 64; // ticks
+  // The first few ticks of each period alternate serial and parallel,
+  // and the mode is settled after the last of them.
+  static constexpr unsigned probe_ticks = 6;
+
+  Sampler(std::vector<std::uint32_t> keys, std::vector<std::unique_ptr<Sensors>> backends)
+    : keys(std::move(keys)), backends(std::move(backends)) {
+    for(std::unique_ptr<Sensors> &b : this->backends)
+      b->prepare(this->keys);
+    for(std::size_t i = 1; i < this->backends.size(); ++i)
+      workers.emplace_back(&Sampler::worker, this, std::ref(*this->backends[i]));
+  }
+
+  ~Sampler() {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      quit = true;
+    }
+    start_cv.notify_all();
+    for(std::thread &t : workers)
+      t.join();
+  }
+
+  std::size_t size() const { return keys.size(); }
+  bool parallel() const { return use_parallel; }
+
+  // Read every key in order on the calling thread.
+  void sample_serial(float *snapshot) {
+    for(std::size_t i = 0; i < keys.size(); ++i)
+      snapshot[i] = backends[0]->read(keys[i]);
+  }
+
+  // Read using all the workers, and the calling thread.
+  void sample_parallel(float *snapshot) {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      out = snapshot;
+      next = 0;
+      running = workers.size();
+      ++generation;
+    }
+    start_cv.notify_all();
+    work(*backends[0]);
+    std::unique_lock<std::mutex> lock(mtx);
+    done_cv.wait(lock, [&]{ return running == 0; });
+  }
+
+  // Fill snapshot[0..size()) with whichever way has been faster lately.
+  void sample(float *snapshot) {
+    unsigned phase = tick++ % probe_period;
+    if(workers.empty() || phase >= probe_ticks) {
+      use_parallel && !workers.empty() ? sample_parallel(snapshot) : sample_serial(snapshot);
+      return;
+    }
+    // Alternate the two, and keep the best of each, so one noisy tick
+    // doesn't decide the mode for the rest of the period.
+    if(phase == 0)
+      serial_time = parallel_time = std::chrono::steady_clock::duration::max();
+    auto t0 = std::chrono::steady_clock::now();
+    if(phase % 2 == 0) {
+      sample_serial(snapshot);
+      serial_time = std::min(serial_time, std::chrono::steady_clock::now() - t0);
+    } else {
+      sample_parallel(snapshot);
+      parallel_time = std::min(parallel_time, std::chrono::steady_clock::now() - t0);
+    }
+    // Demand a real win, not noise, before paying for the threads.
+    if(phase == probe_ticks - 1)
+      use_parallel = parallel_time < serial_time * 9 / 10;
+  }
+};
+
+} // namespace fancurve
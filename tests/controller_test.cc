@@ -0,0 +1,147 @@
+// Runs the C API in fancurve.h against fixed inputs.
+
+#include "fancurve.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      ++failures; \
+    } \
+  } while(0)
+
+#define CHECK_NEAR(a, b) CHECK(std::fabs((a) - (b)) < 1e-5)
+
+// Counts every heap allocation in the program, to check step() makes none.
+long allocations = 0;
+
+const char *const keys[] = {"TC0C", "TTLD", "Ts0P", "TA0P"}; // One of each class.
+
+void test_classify() {
+  CHECK(fancurve_classify("TC0C") == FANCURVE_HOT);
+  CHECK(fancurve_classify("TG0D") == FANCURVE_HOT);
+  CHECK(fancurve_classify("TC0P") == FANCURVE_OTHER); // Proximity.
+  CHECK(fancurve_classify("TTLD") == FANCURVE_WARM);
+  CHECK(fancurve_classify("TPCD") == FANCURVE_WARM);
+  CHECK(fancurve_classify("Ts0P") == FANCURVE_SKIN);
+  CHECK(fancurve_classify("TA0P") == FANCURVE_OTHER);
+}
+
+void test_params() {
+  fancurve_controller *c = fancurve_controller_new(keys, 4, "hot=80:90  floor=20");
+  CHECK(c != nullptr);
+  fancurve_controller_free(c);
+  CHECK(fancurve_controller_new(keys, 4, "hot=90:80") == nullptr);
+  CHECK(fancurve_controller_new(keys, 4, "window=10") == nullptr);
+  CHECK(fancurve_controller_new(keys, 4, "bogus") == nullptr);
+}
+
+void test_headroom() {
+  fancurve_controller *c = fancurve_controller_new(keys, 4, nullptr);
+  float h[FANCURVE_CLASS_COUNT];
+
+  // Before any step there's nothing to report.
+  fancurve_controller_headroom(c, h);
+  for(float x : h)
+    CHECK(std::isnan(x));
+
+  // hot 82:96, warm 65:79, skin 36:40 (docked 40:45), other 60:70.
+  float temps[] = {89.f, 50.f, 42.f, NAN};
+  fancurve_targets t = fancurve_controller_step(c, temps, 0, 0);
+  fancurve_controller_headroom(c, h);
+  CHECK_NEAR(h[FANCURVE_HOT], 0.5f);
+  CHECK_NEAR(h[FANCURVE_WARM], 1.f); // Below low: clamped.
+  CHECK_NEAR(h[FANCURVE_SKIN], 0.f); // Past high: clamped.
+  CHECK(std::isnan(h[FANCURVE_OTHER])); // Failed read.
+  CHECK(t.hottest == 2);
+
+  // Docked, the skin curve is 40:45.
+  t = fancurve_controller_step(c, temps, 1, 0);
+  fancurve_controller_headroom(c, h);
+  CHECK_NEAR(h[FANCURVE_SKIN], 0.6f);
+  CHECK(t.hottest == 0);
+
+  // A failed read is skipped, not treated as hot or cold.
+  float failed[] = {NAN, NAN, NAN, 65.f};
+  t = fancurve_controller_step(c, failed, 0, 0);
+  fancurve_controller_headroom(c, h);
+  CHECK(t.hottest == 3);
+  CHECK(std::isnan(h[FANCURVE_HOT]));
+  CHECK_NEAR(h[FANCURVE_OTHER], 0.5f);
+
+  fancurve_controller_free(c);
+}
+
+void test_filter() {
+  fancurve_controller *c = fancurve_controller_new(keys, 4, "floor=20");
+  float cool[] = {50.f, 50.f, 30.f, 50.f};
+  float hot[] = {96.f, 50.f, 30.f, 50.f};
+
+  // Fans start maxed, until the median of the window is cool.
+  fancurve_targets t = fancurve_controller_step(c, cool, 0, 0);
+  CHECK(t.percent == 99);
+  t = fancurve_controller_step(c, cool, 0, 0);
+  CHECK(t.percent == 20); // Floor.
+  CHECK_NEAR(t.interval, 2.); // Still a 99 in the window.
+  t = fancurve_controller_step(c, cool, 0, 0);
+  CHECK_NEAR(t.interval, 7.);
+
+  // One spike is filtered out, but slows nothing down.
+  t = fancurve_controller_step(c, hot, 0, 0);
+  CHECK(t.percent == 20);
+  CHECK_NEAR(t.interval, 2.);
+  CHECK(fancurve_controller_step(c, hot, 0, 0).percent == 99);
+
+  // Slower on battery.
+  CHECK(fancurve_controller_step(c, cool, 0, 1).interval > 2.);
+  fancurve_controller_free(c);
+}
+
+void test_deterministic_and_allocation_free() {
+  fancurve_controller *a = fancurve_controller_new(keys, 4, nullptr);
+  fancurve_controller *b = fancurve_controller_new(keys, 4, nullptr);
+  bool same = true;
+  long before = allocations;
+  for(int i = 0; i < 1000; ++i) {
+    float temps[] = {70.f + i % 30, 60.f + i % 25, 35.f + i % 8, i % 7 ? 55.f + i % 20 : NAN};
+    int docked = (i / 100) % 2;
+    fancurve_targets ta = fancurve_controller_step(a, temps, docked, i % 3 == 0);
+    fancurve_targets tb = fancurve_controller_step(b, temps, docked, i % 3 == 0);
+    same = same && ta.percent == tb.percent && ta.hottest == tb.hottest && ta.interval == tb.interval;
+  }
+  CHECK(allocations == before);
+  CHECK(same);
+  fancurve_controller_free(a);
+  fancurve_controller_free(b);
+}
+
+} // namespace
+
+void *operator new(std::size_t size) {
+  ++allocations;
+  if(void *p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+int main() {
+  test_classify();
+  test_params();
+  test_headroom();
+  test_filter();
+  test_deterministic_and_allocation_free();
+  if(failures)
+    return 1;
+  std::printf("controller_test: ok\n");
+  return 0;
+}
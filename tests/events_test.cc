@@ -0,0 +1,160 @@
+// Drives await_tick() with a scripted, simulated-time SystemEvents.
+
+#include "controller.h"
+#include "events.h"
+
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+using namespace fancurve;
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      ++failures; \
+    } \
+  } while(0)
+
+/// Plays back events at fixed times. Time only moves inside wait().
+class FakeEvents : public SystemEvents {
+  struct scripted {
+    double at;
+    sys_event e;
+  };
+  std::deque<scripted> script;
+
+public:
+  double t = 0.;
+  bool battery = false;
+  bool dock = false;
+  std::vector<std::string> log; // Fan mode writes and sleep acks, in order.
+
+  // source_changed toggles battery, dock_changed toggles dock.
+  void at(double when, sys_event e) {
+    script.push_back({when, e});
+  }
+
+  double now() override { return t; }
+
+  sys_event wait(double seconds) override {
+    if(!script.empty() && script.front().at <= t + seconds) {
+      scripted s = script.front();
+      script.pop_front();
+      if(s.at > t)
+        t = s.at;
+      if(s.e == sys_event::source_changed)
+        battery = !battery;
+      if(s.e == sys_event::dock_changed)
+        dock = !dock;
+      return s.e;
+    }
+    t += seconds;
+    return sys_event::none;
+  }
+
+  void allow_sleep() override { log.push_back("allow_sleep"); }
+  bool on_battery() override { return battery; }
+  bool docked() override { return dock; }
+
+  std::function<void(bool)> manual() {
+    return [this](bool on) { log.push_back(on ? "manual" : "auto"); };
+  }
+};
+
+void test_timeout() {
+  FakeEvents ev;
+  loop_state st = {false};
+  await_tick(ev, 5., 3, st, ev.manual());
+  CHECK(ev.t == 5.);
+  CHECK(st.burst == 0);
+  CHECK(ev.log.empty());
+}
+
+void test_sleep_wake() {
+  FakeEvents ev;
+  ev.at(1., sys_event::will_sleep);
+  ev.at(100., sys_event::did_wake);
+  loop_state st = {false};
+  await_tick(ev, 5., 3, st, ev.manual());
+  // Fans go back to the firmware before sleep is allowed, and come back on wake.
+  CHECK((ev.log == std::vector<std::string>{"auto", "allow_sleep", "manual"}));
+  // No ticks while asleep; the wake tick is immediate.
+  CHECK(ev.t == 100.);
+  CHECK(st.burst == 2);
+
+  // The burst runs without waiting, then it's back to normal.
+  await_tick(ev, 5., 3, st, ev.manual());
+  await_tick(ev, 5., 3, st, ev.manual());
+  CHECK(ev.t == 100.);
+  CHECK(st.burst == 0);
+  await_tick(ev, 5., 3, st, ev.manual());
+  CHECK(ev.t == 105.);
+}
+
+void test_source_change_keeps_deadline() {
+  FakeEvents ev;
+  ev.at(1., sys_event::source_changed);
+  ev.at(3., sys_event::source_changed);
+  ev.at(4., sys_event::source_changed);
+  loop_state st = {false};
+  await_tick(ev, 5., 3, st, ev.manual());
+  CHECK(st.battery);
+  CHECK(ev.t == 5.); // Not postponed by the events.
+  CHECK(st.burst == 0);
+  CHECK(ev.log.empty());
+}
+
+void test_undock_takes_effect_immediately() {
+  FakeEvents ev;
+  ev.dock = true;
+  ev.at(20., sys_event::dock_changed); // Undock.
+  Controller ctl(curve_params(), {sensor_class::skin});
+  loop_state st = {false};
+  float skin = 42.f; // Fine docked (40-45), too hot on a lap (36-40).
+
+  // The same loop as main(): tick, then wait.
+  targets t;
+  double stepped_at;
+  auto tick = [&] {
+    stepped_at = ev.t;
+    t = ctl.step({&skin, ev.docked(), st.battery});
+    await_tick(ev, t.interval / 1e6, ctl.params().window, st, ev.manual());
+  };
+  while(ev.t < 20.)
+    tick();
+  CHECK(!ev.dock);
+  CHECK(t.percent < 99);
+
+  // Undocked: the fans max out at once, not a few ticks later.
+  do
+    tick();
+  while(t.percent < 99 && ev.t == 20.);
+  CHECK(t.percent == 99);
+  CHECK(stepped_at == 20.);
+}
+
+void test_battery_interval() {
+  Controller ctl(curve_params(), {sensor_class::other});
+  float cool = 20.f;
+  CHECK(ctl.step({&cool, false, false}).interval < ctl.step({&cool, false, true}).interval);
+}
+
+} // namespace
+
+int main() {
+  test_timeout();
+  test_sleep_wake();
+  test_source_change_keeps_deadline();
+  test_undock_takes_effect_immediately();
+  test_battery_interval();
+  if(failures)
+    return 1;
+  std::printf("events_test: ok\n");
+  return 0;
+}
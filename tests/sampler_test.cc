@@ -0,0 +1,74 @@
+// Runs the Sampler against FakeSensors, and checks it picks the faster way.
+
+#include "sampler.h"
+
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace fancurve;
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      ++failures; \
+    } \
+  } while(0)
+
+std::vector<std::uint32_t> some_keys(unsigned n) {
+  std::vector<std::uint32_t> keys;
+  for(unsigned i = 0; i < n; ++i)
+    keys.push_back('TC\x00\x00' | i);
+  return keys;
+}
+
+// Which way the sampler settles on after its first probe.
+bool settles_parallel(std::mutex *driver) {
+  std::vector<std::unique_ptr<Sensors>> backends;
+  for(int i = 0; i < 4; ++i)
+    backends.push_back(std::make_unique<FakeSensors>(500, driver));
+  Sampler sampler(some_keys(16), std::move(backends));
+  std::vector<float> temps(sampler.size());
+  for(unsigned i = 0; i < Sampler::probe_ticks; ++i)
+    sampler.sample(temps.data());
+  return sampler.parallel();
+}
+
+void test_snapshot() {
+  std::vector<std::unique_ptr<Sensors>> backends;
+  for(int i = 0; i < 3; ++i)
+    backends.push_back(std::make_unique<FakeSensors>(0, nullptr));
+  Sampler sampler(some_keys(20), std::move(backends));
+  std::vector<float> serial(sampler.size()), parallel(sampler.size());
+  sampler.sample_serial(serial.data());
+  sampler.sample_parallel(parallel.data());
+  CHECK(serial == parallel);
+  for(std::size_t i = 0; i < serial.size(); ++i)
+    CHECK(serial[i] == 40.f + (i & 0xF));
+}
+
+void test_latency_picks_parallel() {
+  CHECK(settles_parallel(nullptr));
+}
+
+void test_serialized_driver_picks_serial() {
+  std::mutex driver;
+  CHECK(!settles_parallel(&driver));
+}
+
+} // namespace
+
+int main() {
+  test_snapshot();
+  test_latency_picks_parallel();
+  test_serialized_driver_picks_serial();
+  if(failures)
+    return 1;
+  std::printf("sampler_test: ok\n");
+  return 0;
+}